@@ -10,6 +10,35 @@ enum socket_type {
     STYPE_UNIX
 };
 
+// identifiers of socket tuning options, used as bit numbers in socket_opts.requested
+enum socket_opt_id {
+    SOCKOPT_RCVBUF,
+    SOCKOPT_SNDBUF,
+    SOCKOPT_BUSY_POLL,
+    SOCKOPT_NODELAY,
+    SOCKOPT_FASTOPEN,
+    SOCKOPT_DEFER_ACCEPT,
+    SOCKOPT_GSO,
+    SOCKOPT_GRO
+};
+
+#define SOCKOPT_BIT(id) (1u << (id))
+#define sockopt_requested(opts, id) (!!((opts)->requested & SOCKOPT_BIT(id)))
+
+// socket tuning options passed as URI query parameters (e.g. ?rcvbuf=65536&nodelay)
+// only options marked in `requested` are applied, others keep the kernel default
+struct socket_opts {
+    unsigned requested;     // bitmask of SOCKOPT_BIT() for each requested option
+    int rcvbuf;             // SO_RCVBUF, bytes
+    int sndbuf;             // SO_SNDBUF, bytes
+    int busy_poll;          // SO_BUSY_POLL, microseconds
+    int nodelay;            // TCP_NODELAY flag (TCP only)
+    int fastopen;           // TCP_FASTOPEN queue length (TCP only)
+    int defer_accept;       // TCP_DEFER_ACCEPT, seconds (TCP only)
+    int gso;                // UDP_SEGMENT on send flag (UDP only)
+    int gro;                // UDP_GRO on receive flag (UDP only)
+};
+
 // data type to abstract the supported socket designators
 
 // #pragma pack push
@@ -24,5 +53,6 @@ struct socket_uri {
         };
         const char *path;
     };
+    struct socket_opts opts;
 };
 // #pragma pack pop
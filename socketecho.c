@@ -31,6 +31,21 @@
  *      echo -n teststring | nc -u 127.0.0.1 8000       (don't use -v here)
  *   For UNIX:
  *      echo -n teststring | nc -U /tmp/my.socket
+ *
+ * - Sockets may be tuned with URI query parameters, which are applied right after the
+ *   socket creation. Every option reports to stdout whether the kernel accepted it:
+ *       rcvbuf=<bytes>, sndbuf=<bytes>  -- SO_RCVBUF / SO_SNDBUF
+ *       busy_poll=<usec>                -- SO_BUSY_POLL (TCP, UDP; raising needs CAP_NET_ADMIN)
+ *       nodelay                         -- TCP_NODELAY (TCP)
+ *       fastopen=<qlen>                 -- TCP_FASTOPEN (TCP)
+ *       defer_accept=<sec>              -- TCP_DEFER_ACCEPT (TCP)
+ *       gro                             -- UDP_GRO (UDP): one recvmsg() returns a batch of
+ *                                          same-sized datagrams from a peer
+ *       gso                             -- UDP_SEGMENT (UDP): echo replies to such batch are
+ *                                          sent back with a single sendmsg(). Requires gro,
+ *                                          as otherwise there are no batches to reply to
+ *   For example: udp://127.0.0.1:8000?gro&gso&rcvbuf=1048576
+ *                tcp://localhost:8000?nodelay&fastopen=16&defer_accept=5
  *   And remember we don't free up socket resources here, thus you may want to remove socket file
  *   or reclaim the port used.
  *   Proper cleanups on exit will need having SIGINT signal handler provided.
@@ -41,12 +56,15 @@
 #include <netdb.h>              /* getaddrinfo() */
 #include <arpa/inet.h>          /* inet_addr */
 #include <netinet/ip.h>
+#include <netinet/tcp.h>        /* TCP_NODELAY, TCP_FASTOPEN, TCP_DEFER_ACCEPT */
+#include <netinet/udp.h>        /* UDP_SEGMENT, UDP_GRO */
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <argp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>             /* close() */
 
 
 // Here we rely on some heavy typecasting. That's ok and is exactly how
@@ -71,6 +89,253 @@ bool host_resolve(enum socket_type kind, const char *host, struct in_addr *res)
 }
 
 
+// Largest UDP payload over IPv4. Bounds both GRO batches on receive and GSO batches on send
+#define UDP_MAX_PAYLOAD 65507
+// Max datagrams per one GSO send. Kernel UDP_MAX_SEGMENTS is 64 on older kernels
+#define UDP_GSO_MAX_SEGMENTS 64
+// IPv4 (without options) and UDP header sizes. GSO segment plus these must fit into MTU
+#define UDP_IP_HEADERS (20 + 8)
+
+static const char ECHO_PREFIX[] = "Echo: \"";
+static const char ECHO_SUFFIX[] = "\"\n";
+#define ECHO_OVERHEAD ((long)(sizeof(ECHO_PREFIX) + sizeof(ECHO_SUFFIX) - 2))
+
+
+// Sets an int socket option and reports whether it took effect. Failures are not fatal,
+// the socket just keeps the kernel default
+static bool sockopt_set(int sock, int level, int optname, const char *name, int val)
+{
+    if (-1 == setsockopt(sock, level, optname, &val, sizeof(val))) {
+        printf("Option %s=%d not applied (%s)\n", name, val, strerror(errno));
+        return false;
+    }
+    // kernel may adjust the value (i.e. buffer sizes get doubled), so show what we've got
+    int eff = 0;
+    socklen_t efflen = sizeof(eff);
+    if (-1 == getsockopt(sock, level, optname, &eff, &efflen))
+        printf("Option %s=%d applied\n", name, val);
+    else
+        printf("Option %s=%d applied (effective %d)\n", name, val, eff);
+    return true;
+}
+
+
+// Applies options requested in URI, even explicit zeroes. Flags of options that could
+// not be applied are cleared, so the datapath does not rely on them
+static void sockopts_apply(int sock, struct socket_opts *opts)
+{
+    if (sockopt_requested(opts, SOCKOPT_RCVBUF))
+        sockopt_set(sock, SOL_SOCKET, SO_RCVBUF, "rcvbuf", opts->rcvbuf);
+    if (sockopt_requested(opts, SOCKOPT_SNDBUF))
+        sockopt_set(sock, SOL_SOCKET, SO_SNDBUF, "sndbuf", opts->sndbuf);
+    if (sockopt_requested(opts, SOCKOPT_BUSY_POLL))
+        sockopt_set(sock, SOL_SOCKET, SO_BUSY_POLL, "busy_poll", opts->busy_poll);
+    if (sockopt_requested(opts, SOCKOPT_NODELAY))
+        sockopt_set(sock, IPPROTO_TCP, TCP_NODELAY, "nodelay", opts->nodelay);
+    if (sockopt_requested(opts, SOCKOPT_FASTOPEN))
+        sockopt_set(sock, IPPROTO_TCP, TCP_FASTOPEN, "fastopen", opts->fastopen);
+    if (sockopt_requested(opts, SOCKOPT_DEFER_ACCEPT))
+        sockopt_set(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, "defer_accept", opts->defer_accept);
+    if (sockopt_requested(opts, SOCKOPT_GRO)
+        && !sockopt_set(sock, SOL_UDP, UDP_GRO, "gro", opts->gro))
+        opts->gro = 0;
+    // Segment size is passed with every send, here we only check the kernel supports it.
+    // Zero segment size is the socket default meaning "no segmentation".
+    // We only have something to segment when datagrams come in batches, i.e. with GRO
+    if (sockopt_requested(opts, SOCKOPT_GSO)) {
+        int nogso = 0;
+        if (opts->gso && !opts->gro) {
+            printf("Option gso=%d not applied (has no effect without gro)\n", opts->gso);
+            opts->gso = 0;
+        } else if (-1 == setsockopt(sock, SOL_UDP, UDP_SEGMENT, &nogso, sizeof(nogso))) {
+            printf("Option gso=%d not applied (%s)\n", opts->gso, strerror(errno));
+            opts->gso = 0;
+        } else {
+            printf("Option gso=%d applied%s\n", opts->gso,
+                   opts->gso ? " (segment size is set per send)" : "");
+        }
+    }
+}
+
+
+// Receives a datagram. With GRO enabled, kernel may hand over several same-sized datagrams
+// from one peer glued together. Each of them is *segsize bytes long, except maybe the last.
+// Data that did not fit into buf is dropped by kernel, which is reported
+static ssize_t udp_recv(int sock, char *buf, size_t len, struct sockaddr *addr,
+                        socklen_t *addrlen, int *segsize)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    union {                     // union guarantees proper alignment of cmsg
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_name = addr,
+        .msg_namelen = *addrlen,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+    ssize_t cnt = recvmsg(sock, &msg, 0);
+    if (-1 == cnt)
+        return cnt;
+
+    if (msg.msg_flags & MSG_TRUNC)
+        fprintf(stderr, "[sz err datagram truncated to %ld bytes]\n", (long)cnt);
+    *addrlen = msg.msg_namelen;
+    *segsize = 0;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); NULL != cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (SOL_UDP == cm->cmsg_level && UDP_GRO == cm->cmsg_type)
+            memcpy(segsize, CMSG_DATA(cm), sizeof(*segsize));
+    }
+    if (*segsize < 1 || *segsize > cnt)
+        *segsize = cnt;         // nothing was coalesced
+    return cnt;
+}
+
+
+// Sends len bytes to addr. When segsize is less than len, kernel splits them into
+// datagrams of segsize bytes (UDP GSO), so the whole batch costs a single syscall
+static ssize_t udp_send(int sock, const char *buf, size_t len, long segsize,
+                        const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control = {0};
+    struct msghdr msg = {
+        .msg_name = (void *)addr,
+        .msg_namelen = addrlen,
+        .msg_iov = &iov,
+        .msg_iovlen = 1
+    };
+    if (segsize < (long)len) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t gso_size = segsize;
+        memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+    }
+    return sendmsg(sock, &msg, 0);
+}
+
+
+// Path MTUs of recent peers, direct-mapped by peer address. Zero mtu means an empty
+// slot, negative one means the probe failed and MTU is not known
+#define UDP_MTU_CACHE_SIZE 64
+static struct {
+    struct in_addr ip;
+    long mtu;
+} udp_mtu_cache[UDP_MTU_CACHE_SIZE];
+
+#define udp_mtu_slot(addr) \
+    (&udp_mtu_cache[ntohl((addr)->sin_addr.s_addr) % UDP_MTU_CACHE_SIZE])
+
+
+// Returns path MTU towards addr, or a negative value when it can't be found out.
+// IP_MTU is only available on connected sockets and ours is not connected, so
+// a throwaway socket is connected to the peer (UDP connect sends no packets) and asked
+static long udp_path_mtu(const struct sockaddr_in *addr)
+{
+    typeof(udp_mtu_cache[0]) *slot = udp_mtu_slot(addr);
+    if (slot->mtu && slot->ip.s_addr == addr->sin_addr.s_addr)
+        return slot->mtu;
+
+    int mtu = -1;
+    socklen_t mtulen = sizeof(mtu);
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    if (-1 != probe) {
+        if (-1 == connect(probe, (const struct sockaddr *)addr, sizeof(*addr))
+            || -1 == getsockopt(probe, IPPROTO_IP, IP_MTU, &mtu, &mtulen))
+            mtu = -1;
+        close(probe);
+    }
+
+    log_dbg("Path MTU to %s is %d", inet_ntoa(addr->sin_addr), mtu);
+    slot->ip = addr->sin_addr;
+    slot->mtu = mtu;
+    return mtu;
+}
+
+
+// Prints and echoes back every datagram of a (possibly GRO-coalesced) receive.
+// Replies to same-sized datagrams are same-sized too, so with *gso set they are
+// packed together and sent back at once. If kernel does not support that, *gso is cleared
+static void udp_echo(int sock, const char *buf, long cnt, long segsize, bool *gso,
+                     const struct sockaddr *addr, socklen_t addrlen)
+{
+    // extra room lets a single max-sized datagram be echoed, GSO batches are kept smaller
+    static char out[UDP_MAX_PAYLOAD + ECHO_OVERHEAD];
+    const long replysize = segsize + ECHO_OVERHEAD;     // all replies but the last one
+    const char *ip = inet_ntoa(((const struct sockaddr_in *)addr)->sin_addr);
+    long outlen = 0, nseg = 0, off = 0;
+
+    // Replies are a bit larger than what we've received. When they no longer fit into
+    // the path MTU, kernel refuses to segment them, so don't even try for this batch
+    // A single datagram needs no segmentation, so the MTU is not even looked up then
+    bool batch = *gso && cnt > segsize;
+    if (batch) {
+        long mtu = udp_path_mtu((const struct sockaddr_in *)addr);
+        batch = (mtu < 1 || replysize <= mtu - UDP_IP_HEADERS);
+        if (!batch) {
+            log_dbg("Reply size %ld exceeds MTU %ld, not using GSO", replysize, mtu);
+        }
+    }
+
+    do {
+        long seglen = (cnt - off < segsize) ? cnt - off : segsize;
+        printf("[%s (%ld)] %.*s\n", ip, seglen, (int)seglen, buf + off);
+
+        memcpy(out + outlen, ECHO_PREFIX, sizeof(ECHO_PREFIX) - 1);
+        outlen += sizeof(ECHO_PREFIX) - 1;
+        memcpy(out + outlen, buf + off, seglen);
+        outlen += seglen;
+        memcpy(out + outlen, ECHO_SUFFIX, sizeof(ECHO_SUFFIX) - 1);
+        outlen += sizeof(ECHO_SUFFIX) - 1;
+        off += seglen;
+        nseg++;
+
+        if (batch && off < cnt && nseg < UDP_GSO_MAX_SEGMENTS
+            && outlen + replysize <= UDP_MAX_PAYLOAD)
+            continue;           // there is room for more
+
+        long sent = udp_send(sock, out, outlen, replysize, addr, addrlen);
+        if (-1 == sent && nseg > 1) {
+            if (EIO == errno || ENOPROTOOPT == errno) {
+                // GSO is not supported on this path at all
+                fprintf(stderr, "GSO send failed (%s), falling back to per-datagram sends\n",
+                        strerror(errno));
+                *gso = batch = false;
+            } else {
+                // i.e. EINVAL, EMSGSIZE or ENOBUFS. MTU might have changed, forget it
+                fprintf(stderr, "GSO send failed (%s), resending batch per-datagram\n",
+                        strerror(errno));
+                udp_mtu_slot((const struct sockaddr_in *)addr)->mtu = 0;
+            }
+            sent = 0;
+            for (long o = 0; o < outlen; o += replysize) {
+                long len = (outlen - o < replysize) ? outlen - o : replysize;
+                long n = udp_send(sock, out + o, len, len, addr, addrlen);
+                if (n > 0)
+                    sent += n;
+                if (n != len)
+                    break;
+            }
+        }
+        if (sent != outlen)
+            fprintf(stderr, "[sz err %ld < %ld (%s)]\n", sent, outlen, strerror(errno));
+        log_dbg("Sent %ld replies in %ld bytes", nseg, outlen);
+        outlen = nseg = 0;
+    } while (off < cnt);
+    fflush(stdout);
+}
+
+
 static bool err_handle(const char *errmsg, ...)
 {
     va_list va;
@@ -93,6 +358,7 @@ int main(int argc, char *argv[])
 {
     const int CONN_POOL_SIZE = 100;
     const long RECV_BUFFER_SIZE = 1024;
+    const long GRO_BUFFER_SIZE = 65536;    // enough for any coalesced batch
     log_dbg("Size of struct socket_uri %lu", (unsigned long)sizeof(struct socket_uri));
 
     if (argc != 2)
@@ -138,6 +404,7 @@ int main(int argc, char *argv[])
 
     // save exactly what we need and free the rest
     typeof(uri.type) type = uri.type;
+    struct socket_opts opts = uri.opts;
     free(uri.host);
 
     int sock = socket(STYPE_UNIX == type ? AF_UNIX : AF_INET,
@@ -153,6 +420,9 @@ int main(int argc, char *argv[])
              type == STYPE_UNIX ? "UNIX" : 0),
             sock);
 
+    sockopts_apply(sock, &opts);
+    bool gso = opts.gso;
+
     int err = bind(sock, sockaddr, (STYPE_UNIX == type) ? sizeof(struct sockaddr_un)
                                                         : sizeof(struct sockaddr_in));
     free(sockaddr);  // no longer needed since socket was created
@@ -184,7 +454,7 @@ int main(int argc, char *argv[])
 
     while (1) {
         int conn = -1;
-        char buf[RECV_BUFFER_SIZE];
+        char buf[opts.gro ? GRO_BUFFER_SIZE : RECV_BUFFER_SIZE];
         socklen_t cdata_len = cdata_len_st;
 
         if (STYPE_UDP == type) {
@@ -206,9 +476,11 @@ int main(int argc, char *argv[])
         // Receive. As UDP is conectionless, we get the remote addr here
         // For TCP we get addr when the connection is initiated (accept)
         // For UNIX we don't need any addr
-        int cnt = recvfrom(conn, buf, sizeof(buf), 0,
-                           STYPE_UDP == type ? cdata : NULL,
-                           STYPE_UDP == type ? &cdata_len : NULL);
+        // One byte is kept for the string end
+        int segsize = 0;
+        int cnt = (STYPE_UDP == type) ? udp_recv(conn, buf, sizeof(buf) - 1, cdata,
+                                                 &cdata_len, &segsize)
+                                      : recvfrom(conn, buf, sizeof(buf) - 1, 0, NULL, NULL);
         if (-1 == cnt) {
             fprintf(stderr, "Receive error (%s)", strerror(errno));
             if (type != STYPE_UDP)
@@ -220,6 +492,11 @@ int main(int argc, char *argv[])
             printf("[UNDEFINED (%d)] \n", cnt);
             continue;
         }
+        if (STYPE_UDP == type) {
+            log_dbg("Received %d bytes as %d-byte datagrams", cnt, segsize);
+            udp_echo(conn, buf, cnt, segsize, &gso, cdata, cdata_len);
+            continue;
+        }
         if (type != STYPE_UNIX && cdata_len == cdata_len_st)
             printf("[%s (%d)] ", inet_ntoa(((struct sockaddr_in *)cdata)->sin_addr), cnt);
         if (type == STYPE_UNIX)
@@ -230,17 +507,14 @@ int main(int argc, char *argv[])
         snprintf(str, sizeof(str), "%s\n", buf);
         printf("%s", str);
         fflush(stdout);
-        snprintf(str, sizeof(str), "Echo: \"%s\"\n", buf);
+        snprintf(str, sizeof(str), "%s%s%s", ECHO_PREFIX, buf, ECHO_SUFFIX);
 
         unsigned long len = strlen(str);
-        cnt = sendto(conn, str, len, 0,
-                     STYPE_UDP == type ? cdata : NULL,
-                     STYPE_UDP == type ? cdata_len : NULL);
+        cnt = send(conn, str, len, 0);
         if (cnt != len)
             fprintf(stderr, "[sz err %ld < %ld (%s)]\n", (long)cnt, (long)len, strerror(errno));
 
-        if (STYPE_UDP != type)
-            close(conn);
+        close(conn);
     }
 
     return 0;
@@ -17,6 +17,9 @@
  *         )
  *       )$
  *   Here the <ip> and <domain> parts were designed far from optimal to keep them simple.
+ *   Both variants may additionally be followed by "?" + <query> (socket options, like
+ *   "?rcvbuf=65536&nodelay"), which is then split on "&" and "=" by hand in uri_query_parse().
+ *   That's why '?' is not allowed inside UNIX socket paths.
  *   See https://stackoverflow.com/a/106223/5750172 for RFC-compliant hostname regexps.
  *
  *   Sometimes "debugging" of regexps could be tricky, especially for the long ones.
@@ -38,6 +41,7 @@
 #include <sys/un.h>
 #include <limits.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 // Uncomment this if statically linking against pcre
 //#define PCRE2_STATIC
@@ -52,12 +56,41 @@ static const char * const uri_re = (
     "         (?: [a-zA-Z0-9] | [a-zA-Z0-9][a-zA-Z0-9\\-]{0,61} [a-zA-Z0-9] ) "
     "         (?: \\. (?: [a-zA-Z0-9] | [a-zA-Z0-9][a-zA-Z0-9\\-]{0,61} [a-zA-Z0-9] ) ) * "
     "       ) : (?P<port> \\d{1,6}) "
+    "       (?: \\? (?P<query> [^[:cntrl:]]* ) )? "
     "   ) | (?: "
-    "     (?P<proto> unix) : \\/\\/ (?P<path> [^[:cntrl:]] + ) "
+    "     (?P<proto> unix) : \\/\\/ (?P<path> [^[:cntrl:]?] + ) "
+    "     (?: \\? (?P<query> [^[:cntrl:]]* ) )? "
     "   ) "
     " )$ "
 );
-static const char *uri_groupnames[] = {"proto", "host", "port", "path", NULL};
+static const char *uri_groupnames[] = {"proto", "host", "port", "path", "query", NULL};
+
+#define STYPE_BIT(type) (1u << (type))
+
+// Known query parameters. Flags may be given either bare (`?nodelay`) or with
+// a 0/1 value, the rest require an integer value
+static const struct {
+    const char *name;
+    enum socket_opt_id id;  // bit to mark in socket_opts.requested
+    size_t offset;          // where to store the value inside struct socket_opts
+    bool isflag;
+    unsigned types;         // socket types the option is applicable to
+} uri_opts[] = {
+#define URI_OPT(name, id, field, isflag, types) \
+    {name, id, offsetof(struct socket_opts, field), isflag, types}
+    URI_OPT("rcvbuf",       SOCKOPT_RCVBUF,       rcvbuf,       false,
+            STYPE_BIT(STYPE_TCP) | STYPE_BIT(STYPE_UDP) | STYPE_BIT(STYPE_UNIX)),
+    URI_OPT("sndbuf",       SOCKOPT_SNDBUF,       sndbuf,       false,
+            STYPE_BIT(STYPE_TCP) | STYPE_BIT(STYPE_UDP) | STYPE_BIT(STYPE_UNIX)),
+    URI_OPT("busy_poll",    SOCKOPT_BUSY_POLL,    busy_poll,    false,
+            STYPE_BIT(STYPE_TCP) | STYPE_BIT(STYPE_UDP)),
+    URI_OPT("nodelay",      SOCKOPT_NODELAY,      nodelay,      true,  STYPE_BIT(STYPE_TCP)),
+    URI_OPT("fastopen",     SOCKOPT_FASTOPEN,     fastopen,     false, STYPE_BIT(STYPE_TCP)),
+    URI_OPT("defer_accept", SOCKOPT_DEFER_ACCEPT, defer_accept, false, STYPE_BIT(STYPE_TCP)),
+    URI_OPT("gso",          SOCKOPT_GSO,          gso,          true,  STYPE_BIT(STYPE_UDP)),
+    URI_OPT("gro",          SOCKOPT_GRO,          gro,          true,  STYPE_BIT(STYPE_UDP)),
+#undef URI_OPT
+};
 
 // On Linux paths for UNIX sockets could be up to 108 symbols (including '\0')
 // Here we portably calculate that
@@ -189,6 +222,53 @@ code_free:
 }
 
 
+// Parses `key[=value]&key[=value]...` into opts. The query string is modified in place
+static bool uri_query_parse(char *query, enum socket_type type, struct socket_opts *opts)
+{
+    char *saveptr = NULL;
+    for (char *item = strtok_r(query, "&", &saveptr); NULL != item;
+         item = strtok_r(NULL, "&", &saveptr)) {
+        char *val = strchr(item, '=');
+        if (NULL != val)
+            *val++ = '\0';
+
+        long idx = -1;
+        for (long i = 0; i < (long)arr_len(uri_opts); i++) {
+            if (!strcmp(item, uri_opts[i].name)) {
+                idx = i;
+                break;
+            }
+        }
+        if (idx < 0) {
+            log_err("unknown query parameter '%s'", item);
+            return false;
+        }
+        if (!(uri_opts[idx].types & STYPE_BIT(type))) {
+            log_err("query parameter '%s' is not applicable to this socket type", item);
+            return false;
+        }
+
+        long long v = 1;        // bare flag means it is enabled
+        if (NULL == val && !uri_opts[idx].isflag) {
+            log_err("query parameter '%s' requires a value", item);
+            return false;
+        }
+        if (NULL != val) {
+            int end = 0;
+            if (sscanf(val, "%lld%n", &v, &end) < 1 || '\0' != val[end]
+                || v < 0 || v > INT_MAX || (uri_opts[idx].isflag && v > 1)) {
+                log_err("query parameter '%s' has invalid value '%s'", item, val);
+                return false;
+            }
+        }
+        *(int *)((char *)opts + uri_opts[idx].offset) = (int)v;
+        opts->requested |= SOCKOPT_BIT(uri_opts[idx].id);
+        log_dbg("  Option %s=%lld", item, v);
+    }
+    return true;
+}
+
+
 bool uri_parse(const char *uristring, struct socket_uri *resuri)
 {
     log_dbg("UNIX socket path maxlen: %ld", UNIX_SOCKET_PATH_MAXLEN);
@@ -206,8 +286,9 @@ bool uri_parse(const char *uristring, struct socket_uri *resuri)
                *host  = groupvals[1],
                *port  = groupvals[2],
                *path  = groupvals[3];
+    char       *query = groupvals[4];
 
-    log_dbg("PROTO: %s HOST: %s PORT: %s PATH: %s", proto, host, port, path);
+    log_dbg("PROTO: %s HOST: %s PORT: %s PATH: %s QUERY: %s", proto, host, port, path, query);
     struct socket_uri res = {
         .type = (!strcmp(proto, "tcp") ? STYPE_TCP :
                  !strcmp(proto, "udp") ? STYPE_UDP :
@@ -236,10 +317,22 @@ bool uri_parse(const char *uristring, struct socket_uri *resuri)
         }
     }
 
+    if (NULL != query && !uri_query_parse(query, res.type, &res.opts)) {
+        log_err("query conversion failed");
+        goto dealloc;
+    }
+
     ret = true;
     memcpy(resuri, &res, sizeof(res));
 
 dealloc:
+    // host and path live in the union at different offsets, so free the one we've set
+    if (!ret) {
+        if (STYPE_UNIX == res.type)
+            free((char *)res.path);
+        else
+            free(res.host);
+    }
     log_info("Freeing intermediate groupvals");
     arr_foreach(v, groupvals) {
         log_dbg("  %s", v);